@@ -91,6 +91,9 @@
 /*************************************************************************
 *   I N C L U D E
 *************************************************************************/
+#ifndef _GNU_SOURCE  //predefined by g++
+#define _GNU_SOURCE  //ftruncate, fileno, strcasecmp, shm_open with -std=c99
+#endif
 #include <stdio.h>
 
 #ifdef __cplusplus
@@ -105,8 +108,19 @@ extern "C" {
 #include "smadata_layer.h"
 #include "tools.h"
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <math.h>
 #include <time.h>
 #include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
 
 #ifdef __cplusplus
 }
@@ -115,6 +129,7 @@ const char *filename = "/home/rpi/Desktop/SPOTCHANNELS.txt";
 const char *filename3 = "/home/rpi/Desktop/PARAMCHANNELS.txt";
 const char *filenameSetInfo = "/home/rpi/Desktop/SetInformation.txt";
 const char *filenameSunnyLog = "/home/rpi/Desktop/LoggYasdiProgram.txt";
+const char *filenameGatewayConf = "gateway.conf";
 
 /*************************************************************************
 *   F U N C T I O N   D E C L A R A T I O N S
@@ -134,11 +149,136 @@ const char *filenameSunnyLog = "/home/rpi/Desktop/LoggYasdiProgram.txt";
 #define MAXDRIVERS 10   //... and 10 YASDI Bus drivers
 #define EXPECT_CHAN_CNT 300  //lets say that we expect 300 channels in max
                              //for one device
+#define CONF_PATH_LEN 256    //max. length of a file path in gateway.conf
+#define CONF_LINE_LEN (EXPECT_CHAN_CNT*12 + 64) //a list of 300 handles
+
+/* Everything the acquisition loop needs for one cycle: the polled channel
+** handles and the (already opened) data files. A new instance is built by
+** the config watcher thread and handed over to the loop as a whole. */
+typedef struct
+{
+   int   spotCount;
+   DWORD spotValues[EXPECT_CHAN_CNT];
+   int   paramCount;
+   DWORD paramValues[EXPECT_CHAN_CNT];
+   char  spotFile[CONF_PATH_LEN];
+   char  paramFile[CONF_PATH_LEN];
+   char  setInfoFile[CONF_PATH_LEN];
+   char  logFile[CONF_PATH_LEN];
+   char  exportDir[CONF_PATH_LEN];
+   FILE *fpSPOT;
+   FILE *fpPARAM;
+   FILE *fpSet;
+   FILE *fpLogSunny;
+} TGatewayConfig;
+
+/* Shared register image ("/dev/shm/sunnyisland_gateway"). It outlives the
+** gateway process: a standby gateway takes over from it and Server.py
+** reads the quality flags from it. The primary holds a write lock (fcntl)
+** on the segment as long as it lives. Fixed size types only, the layout is
+** also decoded in Server.py! */
+#define SHM_NAME      "/sunnyisland_gateway"
+#define SHM_MAGIC     0x53594753  //"SGYS"
+#define SHM_VERSION   3
+#define SHM_POLL_MS   100         //standby checks the primary this often
+#define SHM_START_MS  300000      //no heartbeat for this long while starting
+#define SHM_HANG_MS   30000       //no heartbeat for this long => hanging
+#define SHM_EXIT_MS   10000       //max. wait for a killed primary to exit
+
+#define OWNER_STARTING 0          //device detection, channel list download
+#define OWNER_RUNNING  1          //acquisition loop
+
+#define QUALITY_STALE 0           //last known value, not updated any more
+#define QUALITY_GOOD  1           //read in the current acquisition cycle
+#define QUALITY_BAD   2           //reading the channel failed
+
+typedef struct
+{
+   uint32_t handle;
+   uint32_t quality;
+   double   value;
+} TSharedChannel;
+
+typedef struct
+{
+   uint32_t magic;
+   uint32_t version;
+   uint64_t heartbeatMs;          //CLOCK_MONOTONIC of the last sign of life
+   uint32_t ownerPid;             //pid of the primary gateway (informative)
+   uint32_t seq;                  //odd while a record is written
+   uint32_t spotCount;            //layout used by the primary (Server.py
+   uint32_t paramCount;           //maps its registers with it)
+   uint32_t ownerState;           //OWNER_STARTING, OWNER_RUNNING
+   uint32_t reserved;
+   TSharedChannel spot[EXPECT_CHAN_CNT];
+   TSharedChannel param[EXPECT_CHAN_CNT];
+   char     spotFile[CONF_PATH_LEN];    //data files of the active config
+   char     paramFile[CONF_PATH_LEN];
+   char     setInfoFile[CONF_PATH_LEN];
+} TSharedState;
+
+/* Export of the acquired samples for offline analysis (see ReadExport.py).
+** One file pair per day (UTC) in ExportDir:
+**   YYYYMMDD.col: blocks of one channel each, a TExportBlock header
+**                 followed by the columns timestamp[rows] (int64, ms since
+**                 1970), value[rows] (double) and quality[rows] (uint8),
+**                 padded with zeros to a multiple of 8 bytes, so that the
+**                 columns of all blocks are 8 byte aligned in the file
+**   YYYYMMDD.idx: a copy of every block header, to find blocks by channel
+**                 and time range without reading the data file
+** Little endian, fixed size types only. */
+#define EXPORT_MAGIC       0x4C4F4353  //"SCOL"
+#define EXPORT_BLOCK_ROWS  256         //samples per channel and block
+#define EXPORT_FLUSH_S     60          //write partial blocks this often
+#define EXPORT_MAX_COLUMNS (2*EXPECT_CHAN_CNT)
+
+typedef struct
+{
+   uint32_t magic;
+   uint32_t channel;              //channel handle
+   uint32_t rows;
+   uint32_t reserved;
+   int64_t  firstTs;
+   int64_t  lastTs;
+   uint64_t offset;               //position of this header in the .col file
+} TExportBlock;
+
+typedef struct
+{
+   DWORD   handle;
+   DWORD   rows;
+   int64_t timestamp[EXPORT_BLOCK_ROWS];
+   double  value[EXPORT_BLOCK_ROWS];
+   uint8_t quality[EXPORT_BLOCK_ROWS];
+} TExportColumn;
 
 /**************************************************************************
 *   S T A T I C
 **************************************************************************/
 
+static TSharedState *SharedState = NULL;
+static int SharedFd = -1;         //keeps the owner lock, never close it!
+
+/* export state, only used by the acquisition loop */
+static char ExportDir[CONF_PATH_LEN];
+static int ExportDay = 0;
+static time_t ExportFlushTime = 0;
+static FILE *ExportData = NULL;
+static FILE *ExportIndex = NULL;
+static TExportColumn *ExportColumns[EXPORT_MAX_COLUMNS];
+static DWORD ExportColumnCount = 0;
+
+/* Config currently used by the acquisition loop. Only DoCommands() reads
+** or replaces it, so the old one can be released right after the swap. */
+static TGatewayConfig *ActiveConfig = NULL;
+
+/* Config built by the watcher thread, waiting for the next cycle boundary.
+** Exchanged atomically between the two threads. */
+static TGatewayConfig *PendingConfig = NULL;
+
+static char GatewayConfPath[CONF_PATH_LEN];
+static char YasdiIniPath[CONF_PATH_LEN];
+
 
 /**************************************************************************
 *   L O C A L   F U N C T I O N S
@@ -146,12 +286,24 @@ const char *filenameSunnyLog = "/home/rpi/Desktop/LoggYasdiProgram.txt";
 
 void PrintDevList( void );
 void PrintDevList( void );
-void PrintChannelValues(TChanType chanType, char *routeDataBase, int flag, FILE *fp);
+void PrintChannelValues(TChanType chanType, const TGatewayConfig *cfg, int flag, FILE *fp);
 void SetParamValue(FILE *fichero);
 void DoStartDetection( int DevCnt );
 void DoStartDetectionAsync( int DevCnt );
 void DoCommands( void );
 int GetDateFromFile();
+TGatewayConfig *LoadGatewayConfig( const char *confFile );
+void FreeGatewayConfig( TGatewayConfig *cfg );
+TGatewayConfig *AcquireGatewayConfig( void );
+int StartConfigWatcher( const char *confFile, const char *iniFile );
+int OpenSharedState( void );
+void RenewHeartbeat( void );
+void SetOwnerState( DWORD state );
+void PublishChannelValue(TChanType chanType, int index, DWORD handle, double value, DWORD quality);
+void MarkChannelStale(TChanType chanType, int index);
+void WaitForTakeover( BOOL bWait );
+void UpdateExport( const TGatewayConfig *cfg );
+void ExportSample(DWORD handle, double value, DWORD quality);
 
 /**************************************************************************
 *   G L O B A L  F U N C T I O N S
@@ -209,7 +361,7 @@ void PrintDevList( void )
                    ********************************************************
                    PRUESSING, 02.07.2001, 1.0, Created
 **************************************************************************/
-void PrintChannelValues(TChanType chanType, char *routeDataBase, int flag, FILE *fp)
+void PrintChannelValues(TChanType chanType, const TGatewayConfig *cfg, int flag, FILE *fp)
 {
    int res;
    //FILE *fp = fopen(routeDataBase, "w");
@@ -226,21 +378,17 @@ void PrintChannelValues(TChanType chanType, char *routeDataBase, int flag, FILE
    char TextValue[30];
    DWORD MaxValueAge = 5; /* maximum age of the channel value in seconds...*/
 
-   int spotValues[18] = {192, 193, 194, 202, 206, 210, 214, 215, 219, 236, 237, 238, 275, 190, 232, 196, 197, 223};// Borre 276, 274
-   int paramValues[29] = {22, 23, 24, 25,26, 9, 10, 17, 18, 19, 20, 31, 32, 33, 34, 35, 36, 48, 49, 50, 51, 52, 53, 64, 65, 66, 67, 75, 76}; // hasta 25 23 y 24 25 repetidos
-
-
-
+   /* the polled channels come from gateway.conf (see LoadGatewayConfig) */
    if(chanType == PARAMCHANNELS && flag == 0){
-      ChanCount = 29;
+      ChanCount = cfg->paramCount;
                 for(int i = 0 ; i < ChanCount; i++){
-                        ChanHandle[i] = paramValues[i];
+                        ChanHandle[i] = cfg->paramValues[i];
                 }
 
    }else if(chanType == SPOTCHANNELS && flag == 0){
-      ChanCount = 18;
+      ChanCount = cfg->spotCount;
       for(int i = 0 ; i < ChanCount; i++){
-                        ChanHandle[i] = spotValues[i];
+                        ChanHandle[i] = cfg->spotValues[i];
                 }
    }else if(chanType == PARAMCHANNELS && flag == 1){
          ChanCount = 1;
@@ -268,8 +416,22 @@ void PrintChannelValues(TChanType chanType, char *routeDataBase, int flag, FILE
       else
       {
          printf("Error reading channel value....error code=%d\n",res);
+         if (flag == 0)
+         {
+            PublishChannelValue(chanType, i, ChanHandle[i], NAN, QUALITY_BAD);
+            ExportSample(ChanHandle[i], NAN, QUALITY_BAD);
+
+            /* the rest of the list is not read in this cycle */
+            for(int j = i+1; j < ChanCount; j++)
+               MarkChannelStale(chanType, j);
+         }
          break;
       }
+      if (flag == 0)
+      {
+         PublishChannelValue(chanType, i, ChanHandle[i], Value, QUALITY_GOOD);
+         ExportSample(ChanHandle[i], Value, QUALITY_GOOD);
+      }
 
      /*printf("     %3lu       | '%16s' | '%s' %c%s%c \n", (unsigned long)ChanHandle[i], ChanName,
             TextValue,
@@ -279,6 +441,10 @@ void PrintChannelValues(TChanType chanType, char *routeDataBase, int flag, FILE
    fprintf(fp, "%s\n", TextValue);
    fflush(fp);
    }
+
+   /* drop the lines of channels removed from the list (or not read) */
+   if (ftruncate(fileno(fp), ftell(fp)) != 0)
+      printf("ERROR: Could not truncate the channel file!\n");
 }
 
 /*
@@ -344,7 +510,9 @@ void SetParamValue(FILE *fichero)
       ChanValue = atof(valor2);
       ChanHandle = atoi(valor1);
       printf("%d -%d\n", ChanHandle, ChanValue);
-      system("truncate -s 0 /home/rpi/Desktop/SetInformation.txt");
+      fflush(fichero);
+      if (ftruncate(fileno(fichero), 0) != 0)
+         printf("ERROR: Could not truncate the set information file!\n");
       iResult = SetChannelValue(ChanHandle, DevHandle, ChanValue );
       if (iResult==0)
          printf("Ok, channel was written!\n");
@@ -541,6 +709,802 @@ int GetDateFromFile(){
    return ChanHandle;
 }
 
+/**************************************************************************
+   Description   : Open one of the data files exchanged with Server.py.
+                   The file is created if it does not exist yet.
+   Parameter     : path: file name
+   Return-Value  : file pointer or NULL
+**************************************************************************/
+static FILE *OpenDataFile( const char *path )
+{
+   FILE *fp = fopen(path, "r+");
+   if (fp == NULL)
+      fp = fopen(path, "w+");
+   if (fp == NULL)
+      printf("ERROR: Could not open '%s'!\n", path);
+   return fp;
+}
+
+/**************************************************************************
+   Description   : Parse a comma separated list of channel handles
+   Parameter     : list:   e.g. "192, 193, 194"
+                   values: destination
+   Return-Value  : number of channels or -1 on error
+**************************************************************************/
+static int ParseChannelList( const char *list, DWORD *values )
+{
+   int count = 0;
+   char *end;
+
+   while(*list)
+   {
+      long handle;
+
+      while(isspace((unsigned char)*list) || *list == ',')
+         list++;
+      if (*list == 0)
+         break;
+
+      handle = strtol(list, &end, 10);
+      if (end == list || handle <= 0 || count >= EXPECT_CHAN_CNT)
+         return -1;
+      values[count++] = (DWORD)handle;
+      list = end;
+   }
+   return count;
+}
+
+/**************************************************************************
+   Description   : Release a gateway config and close its data files
+   Parameter     : cfg: config (may be NULL)
+   Return-Value  : (none)
+**************************************************************************/
+void FreeGatewayConfig( TGatewayConfig *cfg )
+{
+   if (cfg == NULL)
+      return;
+   if (cfg->fpSPOT)     fclose(cfg->fpSPOT);
+   if (cfg->fpPARAM)    fclose(cfg->fpPARAM);
+   if (cfg->fpSet)      fclose(cfg->fpSet);
+   if (cfg->fpLogSunny) fclose(cfg->fpLogSunny);
+   free(cfg);
+}
+
+/**************************************************************************
+   Description   : Build a complete gateway config from "gateway.conf".
+                   Missing keys (or a missing file) keep the built-in
+                   defaults. The data files are opened here, so that the
+                   acquisition loop never has to do it.
+                   Format (one per line, '#' or ';' starts a comment):
+                      SpotChannels  = 192, 193, ...
+                      ParamChannels = 22, 23, ...
+                      SpotFile / ParamFile / SetInfoFile / LogFile = path
+                      ExportDir = directory (empty: no export)
+   Parameter     : confFile: config file name
+   Return-Value  : new config or NULL if it is invalid
+**************************************************************************/
+TGatewayConfig *LoadGatewayConfig( const char *confFile )
+{
+   static const DWORD spotValues[18] = {192, 193, 194, 202, 206, 210, 214, 215, 219, 236, 237, 238, 275, 190, 232, 196, 197, 223};// Borre 276, 274
+   static const DWORD paramValues[29] = {22, 23, 24, 25,26, 9, 10, 17, 18, 19, 20, 31, 32, 33, 34, 35, 36, 48, 49, 50, 51, 52, 53, 64, 65, 66, 67, 75, 76}; // hasta 25 23 y 24 25 repetidos
+   TGatewayConfig *cfg;
+   char line[CONF_LINE_LEN];
+   int lineNr = 0;
+   FILE *fp;
+
+   cfg = (TGatewayConfig*)calloc(1, sizeof(TGatewayConfig));
+   if (cfg == NULL)
+      return NULL;
+
+   /* defaults... */
+   cfg->spotCount = sizeof(spotValues)/sizeof(spotValues[0]);
+   memcpy(cfg->spotValues, spotValues, sizeof(spotValues));
+   cfg->paramCount = sizeof(paramValues)/sizeof(paramValues[0]);
+   memcpy(cfg->paramValues, paramValues, sizeof(paramValues));
+   snprintf(cfg->spotFile,    CONF_PATH_LEN, "%s", filename);
+   snprintf(cfg->paramFile,   CONF_PATH_LEN, "%s", filename3);
+   snprintf(cfg->setInfoFile, CONF_PATH_LEN, "%s", filenameSetInfo);
+   snprintf(cfg->logFile,     CONF_PATH_LEN, "%s", filenameSunnyLog);
+
+   fp = fopen(confFile, "r");
+   if (fp == NULL)
+      printf("No '%s' found, using built-in channel list.\n", confFile);
+
+   while(fp && fgets(line, sizeof(line), fp))
+   {
+      char *key = line;
+      char *value;
+      char *end;
+      int ok = 1;
+
+      lineNr++;
+      if (strchr(line, '\n') == NULL && !feof(fp))
+      {
+         printf("ERROR: %s:%d: line too long\n", confFile, lineNr);
+         fclose(fp);
+         free(cfg);
+         return NULL;
+      }
+      line[strcspn(line, "#;\r\n")] = 0;
+      while(isspace((unsigned char)*key))
+         key++;
+      if (*key == 0 || *key == '[')
+         continue;
+
+      value = strchr(key, '=');
+      if (value == NULL)
+      {
+         printf("ERROR: %s:%d: missing '='\n", confFile, lineNr);
+         fclose(fp);
+         free(cfg);
+         return NULL;
+      }
+
+      /* trim key and value... */
+      end = value;
+      *value++ = 0;
+      while(end > key && isspace((unsigned char)end[-1]))
+         *--end = 0;
+      while(isspace((unsigned char)*value))
+         value++;
+      end = value + strlen(value);
+      while(end > value && isspace((unsigned char)end[-1]))
+         *--end = 0;
+
+      if (strcasecmp(key, "SpotChannels") == 0)
+         ok = (cfg->spotCount = ParseChannelList(value, cfg->spotValues)) >= 0;
+      else if (strcasecmp(key, "ParamChannels") == 0)
+         ok = (cfg->paramCount = ParseChannelList(value, cfg->paramValues)) >= 0;
+      else if (strcasecmp(key, "SpotFile") == 0)
+         ok = snprintf(cfg->spotFile, CONF_PATH_LEN, "%s", value) < CONF_PATH_LEN;
+      else if (strcasecmp(key, "ParamFile") == 0)
+         ok = snprintf(cfg->paramFile, CONF_PATH_LEN, "%s", value) < CONF_PATH_LEN;
+      else if (strcasecmp(key, "SetInfoFile") == 0)
+         ok = snprintf(cfg->setInfoFile, CONF_PATH_LEN, "%s", value) < CONF_PATH_LEN;
+      else if (strcasecmp(key, "LogFile") == 0)
+         ok = snprintf(cfg->logFile, CONF_PATH_LEN, "%s", value) < CONF_PATH_LEN;
+      else if (strcasecmp(key, "ExportDir") == 0)
+         ok = snprintf(cfg->exportDir, CONF_PATH_LEN, "%s", value) < CONF_PATH_LEN;
+      else
+         printf("WARNING: %s:%d: unknown key '%s' ignored\n", confFile, lineNr, key);
+
+      if (!ok)
+      {
+         printf("ERROR: %s:%d: invalid value for '%s'\n", confFile, lineNr, key);
+         fclose(fp);
+         free(cfg);
+         return NULL;
+      }
+   }
+   if (fp)
+      fclose(fp);
+
+   cfg->fpSPOT     = OpenDataFile(cfg->spotFile);
+   cfg->fpPARAM    = OpenDataFile(cfg->paramFile);
+   cfg->fpSet      = OpenDataFile(cfg->setInfoFile);
+   cfg->fpLogSunny = OpenDataFile(cfg->logFile);
+   if (!cfg->fpSPOT || !cfg->fpPARAM || !cfg->fpSet || !cfg->fpLogSunny)
+   {
+      FreeGatewayConfig(cfg);
+      return NULL;
+   }
+   return cfg;
+}
+
+/**************************************************************************
+   Description   : Called by the acquisition loop at the start of every
+                   cycle. If the watcher thread has published a new config
+                   it becomes active now and the old one is released. The
+                   loop is the only reader of ActiveConfig, so nobody can
+                   still be using the old config at this point.
+   Parameter     : (none)
+   Return-Value  : config to use for this cycle
+**************************************************************************/
+TGatewayConfig *AcquireGatewayConfig( void )
+{
+   TGatewayConfig *cfg = __atomic_exchange_n(&PendingConfig, NULL, __ATOMIC_ACQUIRE);
+
+   if (cfg != NULL)
+   {
+      FreeGatewayConfig(ActiveConfig);
+      ActiveConfig = cfg;
+      printf("New gateway config active: %d spot, %d param channels\n",
+             cfg->spotCount, cfg->paramCount);
+   }
+   return ActiveConfig;
+}
+
+/* split "dir/name" into directory and file name part */
+static void SplitPath( const char *path, char *dir, const char **name )
+{
+   const char *slash = strrchr(path, '/');
+
+   if (slash == NULL)
+   {
+      strcpy(dir, ".");
+      *name = path;
+   }
+   else
+   {
+      snprintf(dir, CONF_PATH_LEN, "%.*s", (int)(slash == path ? 1 : slash - path), path);
+      *name = slash + 1;
+   }
+}
+
+/**************************************************************************
+   Description   : Config watcher thread. Waits (inotify) for changes of
+                   gateway.conf and yasdi.ini. The directories are watched
+                   instead of the files because editors usually replace
+                   the file by a rename.
+   Parameter     : (unused)
+   Return-Value  : (none)
+**************************************************************************/
+static void *ConfigWatcherThread( void *arg )
+{
+   char confDir[CONF_PATH_LEN], iniDir[CONF_PATH_LEN];
+   const char *confName, *iniName;
+   char buffer[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+   int fd, wdConf, wdIni;
+   (void)arg;
+
+   SplitPath(GatewayConfPath, confDir, &confName);
+   SplitPath(YasdiIniPath, iniDir, &iniName);
+
+   fd = inotify_init();
+   if (fd < 0)
+   {
+      printf("ERROR: inotify not available, gateway.conf will not be reloaded!\n");
+      return NULL;
+   }
+   wdConf = inotify_add_watch(fd, confDir, IN_CLOSE_WRITE | IN_MOVED_TO);
+   wdIni  = inotify_add_watch(fd, iniDir,  IN_CLOSE_WRITE | IN_MOVED_TO);
+
+   for(;;)
+   {
+      ssize_t len = read(fd, buffer, sizeof(buffer));
+      ssize_t pos;
+      BOOL bReload = FALSE;
+
+      if (len <= 0)
+         break;
+
+      for(pos = 0; pos < len; pos += sizeof(struct inotify_event) + ((struct inotify_event*)&buffer[pos])->len)
+      {
+         const struct inotify_event *ev = (const struct inotify_event*)&buffer[pos];
+
+         if (ev->len == 0)
+            continue;
+         if (ev->wd == wdConf && strcmp(ev->name, confName) == 0)
+            bReload = TRUE;
+         if (ev->wd == wdIni && strcmp(ev->name, iniName) == 0)
+            printf("WARNING: '%s' changed. Driver changes need a restart of the gateway!\n", YasdiIniPath);
+      }
+
+      if (bReload)
+      {
+         TGatewayConfig *cfg = LoadGatewayConfig(GatewayConfPath);
+         if (cfg == NULL)
+         {
+            printf("ERROR: '%s' is invalid, keeping the current config.\n", GatewayConfPath);
+            continue;
+         }
+         /* publish; a config the loop has not picked up yet is dropped */
+         FreeGatewayConfig(__atomic_exchange_n(&PendingConfig, cfg, __ATOMIC_RELEASE));
+      }
+   }
+
+   close(fd);
+   return NULL;
+}
+
+/**************************************************************************
+   Description   : Load the initial gateway config and start the watcher
+   Parameter     : confFile: gateway.conf
+                   iniFile:  yasdi.ini (only for a restart hint)
+   Return-Value  : 0 if ok, -1 if there is no usable config
+**************************************************************************/
+int StartConfigWatcher( const char *confFile, const char *iniFile )
+{
+   pthread_t thread;
+
+   snprintf(GatewayConfPath, CONF_PATH_LEN, "%s", confFile);
+   snprintf(YasdiIniPath, CONF_PATH_LEN, "%s", iniFile);
+
+   ActiveConfig = LoadGatewayConfig(GatewayConfPath);
+   if (ActiveConfig == NULL)
+      return -1;
+
+   if (pthread_create(&thread, NULL, ConfigWatcherThread, NULL) == 0)
+      pthread_detach(thread);
+   else
+      printf("ERROR: Could not start the config watcher!\n");
+   return 0;
+}
+
+/**************************************************************************
+   Description   : Monotonic time in milliseconds (heartbeat clock)
+   Parameter     : (none)
+   Return-Value  : time in ms
+**************************************************************************/
+static uint64_t GetMonotonicMs( void )
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**************************************************************************
+   Description   : Map the shared register image. It is created by the
+                   first gateway process and kept while the system runs,
+                   so a standby (and Server.py) find the last values of
+                   the primary after it died.
+   Parameter     : (none)
+   Return-Value  : 0 if ok, -1 on error
+**************************************************************************/
+int OpenSharedState( void )
+{
+   int fd = shm_open(SHM_NAME, O_RDWR | O_CREAT, 0666);
+
+   if (fd < 0)
+   {
+      printf("ERROR: Could not open shared memory '%s'!\n", SHM_NAME);
+      return -1;
+   }
+   if (ftruncate(fd, sizeof(TSharedState)) != 0)
+   {
+      printf("ERROR: Could not resize shared memory '%s'!\n", SHM_NAME);
+      close(fd);
+      return -1;
+   }
+   SharedState = (TSharedState*)mmap(NULL, sizeof(TSharedState),
+                                     PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+   if (SharedState == MAP_FAILED)
+   {
+      SharedState = NULL;
+      printf("ERROR: Could not map shared memory '%s'!\n", SHM_NAME);
+      close(fd);
+      return -1;
+   }
+
+   /* The owner lock is bound to this descriptor: closing any descriptor of
+   ** the segment in this process would release it (fcntl semantics). */
+   SharedFd = fd;
+   return 0;
+}
+
+/* try to get the owner lock; returns the pid of the current holder or 0 */
+static pid_t TryLockSharedState( void )
+{
+   struct flock lock;
+
+   memset(&lock, 0, sizeof(lock));
+   lock.l_type   = F_WRLCK;
+   lock.l_whence = SEEK_SET;
+   if (fcntl(SharedFd, F_SETLK, &lock) == 0)
+      return 0;
+
+   memset(&lock, 0, sizeof(lock));
+   lock.l_type   = F_WRLCK;
+   lock.l_whence = SEEK_SET;
+   if (fcntl(SharedFd, F_GETLK, &lock) != 0 || lock.l_type == F_UNLCK)
+      return -1;        //released in between, try again
+   return lock.l_pid;
+}
+
+/* is the process gone (exited or zombie, so its files are closed)? */
+static BOOL IsProcessGone( pid_t pid )
+{
+   char path[32];
+   char stat[256];
+   char *state;
+   FILE *fp;
+   BOOL bGone = TRUE;
+
+   if (kill(pid, 0) != 0 && errno == ESRCH)
+      return TRUE;
+
+   snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+   fp = fopen(path, "r");
+   if (fp == NULL)
+      return TRUE;
+   if (fgets(stat, sizeof(stat), fp))
+   {
+      state = strrchr(stat, ')');
+      bGone = state != NULL && state[1] == ' ' && (state[2] == 'Z' || state[2] == 'X');
+   }
+   fclose(fp);
+   return bGone;
+}
+
+/* renew the heartbeat (the standby watches it) */
+void RenewHeartbeat( void )
+{
+   if (SharedState != NULL)
+      __atomic_store_n(&SharedState->heartbeatMs, GetMonotonicMs(), __ATOMIC_RELEASE);
+}
+
+/* OWNER_STARTING has the longer heartbeat timeout (slow detection) */
+void SetOwnerState( DWORD state )
+{
+   if (SharedState == NULL)
+      return;
+   RenewHeartbeat();
+   __atomic_store_n(&SharedState->ownerState, (uint32_t)state, __ATOMIC_RELEASE);
+}
+
+/* mark all channels of the image as stale (values are kept) */
+static void MarkSharedStateStale( void )
+{
+   DWORD i;
+
+   __atomic_add_fetch(&SharedState->seq, 1, __ATOMIC_ACQ_REL);
+   for(i=0;i<EXPECT_CHAN_CNT;i++)
+   {
+      SharedState->spot[i].quality  = QUALITY_STALE;
+      SharedState->param[i].quality = QUALITY_STALE;
+   }
+   __atomic_add_fetch(&SharedState->seq, 1, __ATOMIC_ACQ_REL);
+}
+
+/**************************************************************************
+   Description   : Store one acquired channel in the register image and
+                   renew the heartbeat. Readers use "seq" like a seqlock:
+                   it is odd while the record is being written.
+   Parameter     : chanType: SPOTCHANNELS or PARAMCHANNELS
+                   index:    position in the channel list (= line in file)
+                   handle:   channel handle
+                   value:    channel value
+                   quality:  QUALITY_GOOD, ...
+   Return-Value  : (none)
+**************************************************************************/
+void PublishChannelValue(TChanType chanType, int index, DWORD handle, double value, DWORD quality)
+{
+   TSharedChannel *chan;
+
+   if (SharedState == NULL || index >= EXPECT_CHAN_CNT)
+      return;
+
+   chan = (chanType == SPOTCHANNELS) ? &SharedState->spot[index] : &SharedState->param[index];
+   __atomic_add_fetch(&SharedState->seq, 1, __ATOMIC_ACQ_REL);
+   chan->handle  = (uint32_t)handle;
+   chan->quality = (uint32_t)quality;
+   chan->value   = value;
+   __atomic_add_fetch(&SharedState->seq, 1, __ATOMIC_ACQ_REL);
+
+   RenewHeartbeat();
+}
+
+/* a channel not read in this cycle keeps its value, but is stale */
+void MarkChannelStale(TChanType chanType, int index)
+{
+   if (SharedState == NULL || index >= EXPECT_CHAN_CNT)
+      return;
+
+   __atomic_add_fetch(&SharedState->seq, 1, __ATOMIC_ACQ_REL);
+   if (chanType == SPOTCHANNELS)
+      SharedState->spot[index].quality = QUALITY_STALE;
+   else
+      SharedState->param[index].quality = QUALITY_STALE;
+   __atomic_add_fetch(&SharedState->seq, 1, __ATOMIC_ACQ_REL);
+}
+
+/* publish the channel counts and data files of the active config, so
+** Server.py uses exactly the layout the gateway writes */
+static void PublishLayout( const TGatewayConfig *cfg )
+{
+   if (SharedState == NULL)
+      return;
+   __atomic_add_fetch(&SharedState->seq, 1, __ATOMIC_ACQ_REL);
+   SharedState->spotCount  = (uint32_t)cfg->spotCount;
+   SharedState->paramCount = (uint32_t)cfg->paramCount;
+   memcpy(SharedState->spotFile,    cfg->spotFile,    CONF_PATH_LEN);
+   memcpy(SharedState->paramFile,   cfg->paramFile,   CONF_PATH_LEN);
+   memcpy(SharedState->setInfoFile, cfg->setInfoFile, CONF_PATH_LEN);
+   __atomic_add_fetch(&SharedState->seq, 1, __ATOMIC_ACQ_REL);
+}
+
+/**************************************************************************
+   Description   : Standby mode. Waits until the current primary is gone
+                   and then claims the register image for this process.
+                   The primary is the holder of the fcntl write lock on
+                   the segment; the kernel drops the lock when it dies, so
+                   a crash is noticed within one poll interval. A stale
+                   pid in the image is never used.
+                   A primary that holds the lock but has no heartbeat for
+                   SHM_HANG_MS (SHM_START_MS while starting) hangs in the
+                   bus driver: it is killed, and we wait until it is
+                   really gone, two masters on the RS485 bus must never
+                   happen. The values are marked stale until they are
+                   read again.
+   Parameter     : bWait: FALSE => claim only if there is no live primary
+   Return-Value  : (none)
+**************************************************************************/
+void WaitForTakeover( BOOL bWait )
+{
+   pid_t lastOwner = 0;
+   pid_t killedOwner = 0;
+   uint64_t ownerSeen = 0;
+
+   for(;;)
+   {
+      pid_t owner = TryLockSharedState();
+
+      if (owner == 0)
+         break;
+
+      if (owner > 0)
+      {
+         uint32_t state = __atomic_load_n(&SharedState->ownerState, __ATOMIC_ACQUIRE);
+         uint64_t beat  = __atomic_load_n(&SharedState->heartbeatMs, __ATOMIC_ACQUIRE);
+         uint64_t limit = (state == OWNER_RUNNING) ? SHM_HANG_MS : SHM_START_MS;
+         uint64_t now   = GetMonotonicMs();
+
+         /* a new owner may not have written its first heartbeat yet */
+         if (owner != lastOwner)
+         {
+            lastOwner = owner;
+            ownerSeen = now;
+         }
+         if (beat < ownerSeen)
+            beat = ownerSeen;
+
+         if (now - beat > limit && owner != killedOwner)
+         {
+            printf("Primary gateway (pid %d) hangs since %lu ms, killing it...\n",
+                   (int)owner, (unsigned long)(now - beat));
+            kill(owner, SIGKILL);
+            killedOwner = owner;
+         }
+         else if (!bWait)
+         {
+            printf("WARNING: Gateway pid %d is already running, waiting as standby...\n",
+                   (int)owner);
+            bWait = TRUE;
+         }
+      }
+      usleep(SHM_POLL_MS * 1000);
+   }
+
+   /* the lock is released while the process closes its files, the tty may
+   ** still be open: wait until it is really gone */
+   if (lastOwner > 0)
+   {
+      uint64_t start = GetMonotonicMs();
+
+      printf("Primary gateway (pid %d) is gone, taking over...\n", (int)lastOwner);
+      while(!IsProcessGone(lastOwner) && GetMonotonicMs() - start < SHM_EXIT_MS)
+         usleep(SHM_POLL_MS * 1000);
+   }
+
+   /* a fresh (zeroed) segment or one of an older gateway? */
+   if (SharedState->magic != SHM_MAGIC || SharedState->version != SHM_VERSION)
+   {
+      memset(SharedState, 0, sizeof(TSharedState));
+      SharedState->magic = SHM_MAGIC;
+      SharedState->version = SHM_VERSION;
+   }
+
+   /* the last owner may have died inside a write, seq could be odd */
+   __atomic_store_n(&SharedState->seq, (__atomic_load_n(&SharedState->seq, __ATOMIC_ACQUIRE) + 1) & ~1u, __ATOMIC_RELEASE);
+   __atomic_store_n(&SharedState->ownerPid, (uint32_t)getpid(), __ATOMIC_RELEASE);
+   SetOwnerState(OWNER_STARTING);
+   MarkSharedStateStale();
+}
+
+/**************************************************************************
+   Description   : Realtime clock in milliseconds since 1970 (UTC)
+   Parameter     : (none)
+   Return-Value  : time in ms
+**************************************************************************/
+static int64_t GetRealtimeMs( void )
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_REALTIME, &ts);
+   return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**************************************************************************
+   Description   : Write the buffered samples of one channel as a block
+                   to the data file and add it to the index. The data is
+                   written first, so the index never points behind the
+                   end of the data file.
+   Parameter     : col: channel buffer
+   Return-Value  : (none)
+**************************************************************************/
+static void FlushExportColumn( TExportColumn *col )
+{
+   static const uint8_t padding[8] = {0};
+   TExportBlock block;
+   size_t pad = (8 - col->rows % 8) % 8;
+   long offset;
+   long idxOffset;
+
+   if (col->rows == 0 || ExportData == NULL)
+      return;
+
+   memset(&block, 0, sizeof(block));
+   block.magic   = EXPORT_MAGIC;
+   block.channel = col->handle;
+   block.rows    = col->rows;
+   block.firstTs = col->timestamp[0];
+   block.lastTs  = col->timestamp[col->rows-1];
+
+   fseek(ExportData, 0, SEEK_END);
+   offset = ftell(ExportData);
+   block.offset = (uint64_t)offset;
+   fseek(ExportIndex, 0, SEEK_END);
+   idxOffset = ftell(ExportIndex);
+
+   if (fwrite(&block, sizeof(block), 1, ExportData) != 1 ||
+       fwrite(col->timestamp, sizeof(int64_t), col->rows, ExportData) != col->rows ||
+       fwrite(col->value, sizeof(double), col->rows, ExportData) != col->rows ||
+       fwrite(col->quality, sizeof(uint8_t), col->rows, ExportData) != col->rows ||
+       fwrite(padding, 1, pad, ExportData) != pad ||
+       fflush(ExportData) != 0 ||
+       fwrite(&block, sizeof(block), 1, ExportIndex) != 1 ||
+       fflush(ExportIndex) != 0)
+   {
+      printf("ERROR: Could not write export data, %lu samples lost!\n", (unsigned long)col->rows);
+      clearerr(ExportData);
+      clearerr(ExportIndex);
+      /* cut off the partial block and index record, a misaligned index
+      ** would make all later records of the day unreadable */
+      if (ftruncate(fileno(ExportData), offset) != 0 ||
+          ftruncate(fileno(ExportIndex), idxOffset) != 0)
+         printf("ERROR: Export files are damaged!\n");
+   }
+   col->rows = 0;
+}
+
+/* flush all buffered samples and close the files of the current day */
+static void CloseExportFiles( void )
+{
+   DWORD i;
+
+   for(i=0;i<ExportColumnCount;i++)
+      FlushExportColumn(ExportColumns[i]);
+   if (ExportData)  fclose(ExportData);
+   if (ExportIndex) fclose(ExportIndex);
+   ExportData  = NULL;
+   ExportIndex = NULL;
+}
+
+/**************************************************************************
+   Description   : After a crash the files of the day may end with a
+                   partial index record or a partial block. Cut both back
+                   to the last complete block before appending to them.
+   Parameter     : (none)
+   Return-Value  : (none)
+**************************************************************************/
+static void RepairExportFiles( void )
+{
+   TExportBlock block;
+   long idxSize, dataSize, dataEnd = 0;
+
+   fseek(ExportIndex, 0, SEEK_END);
+   idxSize = ftell(ExportIndex);
+   idxSize -= idxSize % sizeof(TExportBlock);
+   if (ftruncate(fileno(ExportIndex), idxSize) != 0)
+      printf("ERROR: Could not repair the export index!\n");
+
+   if (idxSize > 0)
+   {
+      if (pread(fileno(ExportIndex), &block, sizeof(block), idxSize - sizeof(block)) != sizeof(block))
+      {
+         printf("ERROR: Could not read the export index!\n");
+         return;
+      }
+      dataEnd = (long)block.offset + sizeof(TExportBlock) + block.rows*16 + (block.rows+7)/8*8;
+   }
+
+   fseek(ExportData, 0, SEEK_END);
+   dataSize = ftell(ExportData);
+   if (dataSize > dataEnd && ftruncate(fileno(ExportData), dataEnd) != 0)
+      printf("ERROR: Could not repair the export data file!\n");
+}
+
+/* open (append) the data and index file of the given day */
+static void OpenExportFiles( int day )
+{
+   char path[CONF_PATH_LEN + 32];
+
+   snprintf(path, sizeof(path), "%s/%08d.col", ExportDir, day);
+   ExportData = fopen(path, "ab");
+   snprintf(path, sizeof(path), "%s/%08d.idx", ExportDir, day);
+   ExportIndex = fopen(path, "a+b");
+   if (ExportData == NULL || ExportIndex == NULL)
+   {
+      printf("ERROR: Could not open export files in '%s'!\n", ExportDir);
+      CloseExportFiles();
+   }
+   else
+      RepairExportFiles();
+   ExportDay = day;
+}
+
+/**************************************************************************
+   Description   : Called once per acquisition cycle. Follows a changed
+                   export directory, starts a new file pair at midnight
+                   (UTC) and writes partial blocks every EXPORT_FLUSH_S,
+                   so a crash loses at most that much data.
+   Parameter     : cfg: active gateway config
+   Return-Value  : (none)
+**************************************************************************/
+void UpdateExport( const TGatewayConfig *cfg )
+{
+   time_t t = time(NULL);
+   struct tm tm = *gmtime(&t);
+   int day = (tm.tm_year+1900)*10000 + (tm.tm_mon+1)*100 + tm.tm_mday;
+   DWORD i;
+
+   if (strcmp(cfg->exportDir, ExportDir) != 0)
+   {
+      CloseExportFiles();
+      strcpy(ExportDir, cfg->exportDir);
+      ExportDay = 0;
+      if (ExportDir[0])
+         printf("Exporting acquired data to '%s'\n", ExportDir);
+   }
+   if (ExportDir[0] == 0)
+      return;
+
+   if (day != ExportDay)
+   {
+      CloseExportFiles();
+      OpenExportFiles(day);
+      ExportFlushTime = t;
+   }
+   else if (t - ExportFlushTime >= EXPORT_FLUSH_S)
+   {
+      for(i=0;i<ExportColumnCount;i++)
+         FlushExportColumn(ExportColumns[i]);
+      ExportFlushTime = t;
+   }
+}
+
+/**************************************************************************
+   Description   : Buffer one acquired sample for the export. Each channel
+                   has a fixed size buffer, so the memory does not grow
+                   with the amount of exported data.
+   Parameter     : handle:  channel handle
+                   value:   channel value
+                   quality: QUALITY_GOOD, ...
+   Return-Value  : (none)
+**************************************************************************/
+void ExportSample(DWORD handle, double value, DWORD quality)
+{
+   TExportColumn *col = NULL;
+   DWORD i;
+
+   if (ExportData == NULL)
+      return;
+
+   for(i=0;i<ExportColumnCount;i++)
+   {
+      if (ExportColumns[i]->handle == handle)
+      {
+         col = ExportColumns[i];
+         break;
+      }
+   }
+   if (col == NULL)
+   {
+      if (ExportColumnCount >= EXPORT_MAX_COLUMNS)
+         return;
+      col = (TExportColumn*)calloc(1, sizeof(TExportColumn));
+      if (col == NULL)
+         return;
+      col->handle = handle;
+      ExportColumns[ExportColumnCount++] = col;
+   }
+
+   col->timestamp[col->rows] = GetRealtimeMs();
+   col->value[col->rows]     = value;
+   col->quality[col->rows]   = (uint8_t)quality;
+   if (++col->rows == EXPORT_BLOCK_ROWS)
+      FlushExportColumn(col);
+}
+
 void DoCommands( void )
 {
    //char Cmd;
@@ -549,13 +1513,20 @@ void DoCommands( void )
    int newDate;
    DoStartDetection(1);
    DoChangeAccessLevel();
-   const FILE *fpSPOT = fopen(filename, "r+");
-   const FILE *fpPARAM = fopen(filename3, "r+");
-   const FILE *fpSet = fopen(filenameSetInfo, "r+");
-   const FILE *fpLogSunny = fopen(filenameSunnyLog, "r+");
+   SetOwnerState(OWNER_RUNNING);
 
    while(!bEnd)
    {
+      /* pick up a reloaded gateway.conf between two cycles */
+      TGatewayConfig *cfg = AcquireGatewayConfig();
+      RenewHeartbeat();    //the loop makes progress, even without channels
+      PublishLayout(cfg);
+      UpdateExport(cfg);
+      FILE *fpSPOT = cfg->fpSPOT;
+      FILE *fpPARAM = cfg->fpPARAM;
+      FILE *fpSet = cfg->fpSet;
+      FILE *fpLogSunny = cfg->fpLogSunny;
+
       // 4
       time_t t;
       t = time(NULL);
@@ -573,12 +1544,12 @@ void DoCommands( void )
       fprintf(fpLogSunny, "InicioSetParam1: %d, %d, %d, %d, %d, %d\n", day, month, year, hour, min, sec);
       SetParamValue(fpSet);
       //printf("PRINT SPOTCHANNELS");
-      PrintChannelValues( SPOTCHANNELS, filename, 0, fpSPOT); /* only all spot channels */
+      PrintChannelValues( SPOTCHANNELS, cfg, 0, fpSPOT); /* only all spot channels */
       fprintf(fpLogSunny, "Acaba spotchannels: %d - %d - %d - %d - %d - %d\n", day, month, year, hour, min, sec);
       SetParamValue(fpSet);
       fprintf(fpLogSunny, "Acaba 2 set param: %d - %d - %d - %d - %d - %d\n", day, month, year, hour, min, sec);
       //printf("PRINT PARAMACHANNELS");
-      PrintChannelValues( PARAMCHANNELS, filename3, 0, fpPARAM); /* only all parameter channels */
+      PrintChannelValues( PARAMCHANNELS, cfg, 0, fpPARAM); /* only all parameter channels */
       fprintf(fpLogSunny, "Termina todo el recorrido: %d - %d - %d - %d - %d - %d\n", day, month, year, hour, min, sec);
    }
 }
@@ -589,6 +1560,9 @@ void cbDeviceDetectionEvent(TYASDIDetectionSub event, DWORD DeviceHandle, DWORD
 {
    char NameBuffer[30]={0};
 
+   //detection and channel list download are slow, show the standby we live
+   RenewHeartbeat();
+
    //resolve the device handle and get the device name if possible...
    GetDeviceName(DeviceHandle, NameBuffer, sizeof(NameBuffer)-1);
 
@@ -647,11 +1621,17 @@ int main(int argv, char **argc)
    char DriverName[30];
    BOOL bOnDriverOnline = FALSE; //Is at least one driver online?
    char IniFile[]="yasdi.ini";
+   const char *ConfFile = filenameGatewayConf;
+   BOOL bStandby = FALSE;
 
    if (argv>=2)
    {
       strcpy(IniFile,argc[1]);
    }
+   if (argv>=3)
+      bStandby = strnicmp("standby", argc[2], 7) == 0;
+   if (argv>=4)
+      ConfFile = argc[3];
 
   // printf("************************************************************\n");
    //printf("\n");
@@ -670,6 +1650,25 @@ int main(int argv, char **argc)
    yasdiMasterAddEventListener( cbDeviceDetectionEvent, YASDI_EVENT_DEVICE_DETECTION );
 
 
+   /* Channel list and data files (reloaded on change)... */
+   if (StartConfigWatcher( ConfFile, IniFile ) != 0)
+   {
+      printf("ERROR: No usable gateway config!\n");
+      yasdiMasterShutdown();
+      return 1;
+   }
+
+   /* Shared register image. The serial bus is not touched before this
+   ** process owns it (standby: until the primary is gone)... */
+   if (OpenSharedState() != 0)
+   {
+      yasdiMasterShutdown();
+      return 1;
+   }
+   if (bStandby)
+      printf("Standby mode, waiting for the primary gateway to fail...\n");
+   WaitForTakeover( bStandby );
+
    /* get List of all supported drivers...*/
    dDriverNum = yasdiMasterGetDriver( Driver, MAXDRIVERS );
 
@@ -700,7 +1699,6 @@ int main(int argv, char **argc)
            if (strnicmp("autodetect", argc[2], 10) == 0)
                    DoStartDetection( 1 );
 
-
    /* Start "User interface"... */
    DoCommands();
 
@@ -0,0 +1,103 @@
+import argparse
+import os
+import sys
+from datetime import datetime, timezone
+import numpy as np
+
+# Formato escrito por CommonShellUIMain.c (TExportBlock): un par de archivos
+# por dia (UTC), YYYYMMDD.col con los bloques de datos y YYYYMMDD.idx con
+# una copia de cada cabecera de bloque.
+EXPORT_MAGIC = 0x4C4F4353
+BLOCK = np.dtype([("magic", "<u4"), ("channel", "<u4"), ("rows", "<u4"), ("reserved", "<u4"),
+                  ("firstTs", "<i8"), ("lastTs", "<i8"), ("offset", "<u8")])
+
+def toMs(moment):
+        # datetime (sin zona = UTC) o milisegundos desde 1970
+        if moment is None or isinstance(moment, (int, np.integer)):
+                return moment
+        if moment.tzinfo is None:
+                moment = moment.replace(tzinfo = timezone.utc)
+        return int(moment.timestamp() * 1000)
+
+def dayOf(ms):
+        return int(datetime.fromtimestamp(ms / 1000, timezone.utc).strftime("%Y%m%d"))
+
+def readBlocks(route, blocks):
+        # Lee todas las filas de los bloques seleccionados de un archivo
+        # .col de una sola vez (memmap + indices), sin un bucle por bloque.
+        # Las columnas de cada bloque estan alineadas a 8 bytes.
+        data = np.memmap(route, dtype = "u1", mode = "r")
+        words = data[:len(data) // 8 * 8].view("<i8")
+        rows = blocks["rows"].astype(np.int64)
+        start = blocks["offset"].astype(np.int64) + BLOCK.itemsize
+        first = np.cumsum(rows) - rows
+        within = np.arange(rows.sum()) - np.repeat(first, rows)
+        word = np.repeat(start // 8, rows) + within
+        rowsPerRow = np.repeat(rows, rows)
+        timestamp = np.array(words[word])
+        value = np.array(words[word + rowsPerRow]).view("<f8")
+        quality = np.array(data[np.repeat(start, rows) + 16 * rowsPerRow + within])
+        channel = np.repeat(blocks["channel"], rows)
+        return channel, timestamp, value, quality
+
+def readExport(directory, channels = None, start = None, end = None):
+        # Devuelve {canal: (timestamp_ms, valor, calidad)} con arrays numpy.
+        # Solo se leen los bloques del indice que coinciden con los canales
+        # y el rango de tiempo [start, end].
+        start, end = toMs(start), toMs(end)
+        parts = []
+        days = sorted(int(name[:8]) for name in os.listdir(directory)
+                      if name.endswith(".idx") and name[:8].isdigit())
+        # el gateway cambia de archivo al inicio de un ciclo, las primeras
+        # muestras de un dia pueden estar en el archivo del dia anterior
+        firstDay = dayOf(start - 86400000) if start is not None else None
+        for day in days:
+                if (firstDay is not None and day < firstDay) or (end is not None and day > dayOf(end)):
+                        continue
+                index = np.fromfile(os.path.join(directory, "%08d.idx" % day), dtype = BLOCK)
+                mask = index["magic"] == EXPORT_MAGIC
+                if channels is not None:
+                        mask &= np.isin(index["channel"], list(channels))
+                if start is not None:
+                        mask &= index["lastTs"] >= start
+                if end is not None:
+                        mask &= index["firstTs"] <= end
+                if mask.any():
+                        parts.append(readBlocks(os.path.join(directory, "%08d.col" % day), index[mask]))
+
+        if not parts:
+                return {}
+        channel, timestamp, value, quality = (np.concatenate(column) for column in zip(*parts))
+        keep = np.ones(len(timestamp), dtype = bool)
+        if start is not None:
+                keep &= timestamp >= start
+        if end is not None:
+                keep &= timestamp <= end
+        channel, timestamp, value, quality = channel[keep], timestamp[keep], value[keep], quality[keep]
+
+        # agrupar por canal; el orden estable conserva el orden en el tiempo
+        order = np.argsort(channel, kind = "stable")
+        ids, first = np.unique(channel[order], return_index = True)
+        result = {}
+        for channelId, rowIndex in zip(ids, np.split(order, first[1:])):
+                result[int(channelId)] = (timestamp[rowIndex], value[rowIndex], quality[rowIndex])
+        return result
+
+if __name__ == "__main__":
+        parser = argparse.ArgumentParser(description = "Exporta a CSV los datos adquiridos por el gateway")
+        parser.add_argument("directory", help = "ExportDir de gateway.conf")
+        parser.add_argument("--channels", help = "lista de canales, p. ej. 192,193")
+        parser.add_argument("--start", help = "inicio UTC, p. ej. 2024-05-01T00:00")
+        parser.add_argument("--end", help = "fin UTC")
+        args = parser.parse_args()
+
+        channels = [int(c) for c in args.channels.split(",")] if args.channels else None
+        start = datetime.fromisoformat(args.start) if args.start else None
+        end = datetime.fromisoformat(args.end) if args.end else None
+
+        print("channel,timestamp,value,quality")
+        for channel, (timestamp, value, quality) in sorted(readExport(args.directory, channels, start, end).items()):
+                for row in zip(timestamp, value, quality):
+                        sys.stdout.write("%d,%s,%r,%d\n" % (channel,
+                                         datetime.fromtimestamp(row[0] / 1000, timezone.utc).isoformat(),
+                                         float(row[1]), row[2]))
@@ -7,9 +7,73 @@ import threading
 import socket
 from datetime import datetime
 import logging
+import mmap
+import struct
+import time
+
+# Imagen de registros compartida con CommonShellUIMain.c (TSharedState)
+SHM_ROUTE = "/dev/shm/sunnyisland_gateway"
+SHM_MAGIC = 0x53594753
+SHM_VERSION = 3
+SHM_HEADER = struct.Struct("<IIQIIIIII")
+SHM_CHANNEL = struct.Struct("<IId")
+SHM_CHAN_CNT = 300
+QUALITY_GOOD = 1
+MAX_HEARTBEAT_AGE = 10.0   # segundos sin leer un canal => datos viejos
+
+SHM_PATH_LEN = 256
+SHM_PATHS = SHM_HEADER.size + 2 * SHM_CHAN_CNT * SHM_CHANNEL.size
+
+# Distribucion de registros y archivos que usa el gateway; se toma de la
+# imagen compartida (la publica el gateway con la configuracion activa)
+layout = {"spotFile": "/home/rpi/Desktop/SPOTCHANNELS.txt",
+          "paramFile": "/home/rpi/Desktop/PARAMCHANNELS.txt",
+          "setInfoFile": "/home/rpi/Desktop/SetInformation.txt",
+          "spotCount": 18,
+          "paramCount": 29}
+
+def ReadPath(shm, index):
+        raw = shm[SHM_PATHS + index * SHM_PATH_LEN:SHM_PATHS + (index + 1) * SHM_PATH_LEN]
+        return raw.split(b"\0")[0].decode(errors = "replace")
+
+def ReadSharedState():
+        # Actualiza "layout" y devuelve un bit por registro (True = valor
+        # actual), en el mismo orden que los registros de entrada: SPOT y
+        # luego PARAM
+        global layout
+        try:
+                with open(SHM_ROUTE, "rb") as f:
+                        shm = mmap.mmap(f.fileno(), 0, access = mmap.ACCESS_READ)
+        except (OSError, ValueError):
+                return [False] * (layout["spotCount"] + layout["paramCount"])
+        with shm:
+                for retry in range(10):
+                        magic, version, heartbeat, owner, seq, spotCount, paramCount = SHM_HEADER.unpack_from(shm, 0)[0:7]
+                        if magic != SHM_MAGIC or version != SHM_VERSION or len(shm) < SHM_PATHS + 3 * SHM_PATH_LEN:
+                                break
+                        if seq % 2 != 0:
+                                continue
+                        spot = [SHM_CHANNEL.unpack_from(shm, SHM_HEADER.size + i * SHM_CHANNEL.size)[1] for i in range(spotCount)]
+                        param = [SHM_CHANNEL.unpack_from(shm, SHM_HEADER.size + (SHM_CHAN_CNT + i) * SHM_CHANNEL.size)[1] for i in range(paramCount)]
+                        newLayout = {"spotFile": ReadPath(shm, 0),
+                                     "paramFile": ReadPath(shm, 1),
+                                     "setInfoFile": ReadPath(shm, 2),
+                                     "spotCount": spotCount,
+                                     "paramCount": paramCount}
+                        if SHM_HEADER.unpack_from(shm, 0)[4] != seq:
+                                continue
+                        # un gateway que aun no publico su configuracion
+                        if newLayout["spotFile"] and newLayout != layout:
+                                logging.info("Nueva configuracion: %s", newLayout)
+                                layout = newLayout
+                        # el pid puede ser reutilizado, solo cuenta el heartbeat
+                        age = time.clock_gettime(time.CLOCK_MONOTONIC) - heartbeat / 1000.0
+                        if owner != 0 and age <= MAX_HEARTBEAT_AGE and newLayout == layout:
+                                return [q == QUALITY_GOOD for q in spot + param]
+                        break
+        return [False] * (layout["spotCount"] + layout["paramCount"])
 
 def NewConfiguration(server, route):
-        settingRoute = "/home/rpi/Desktop/SetInformation.txt"
         sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
         serverAddress = ("192.168.xxx.xxx", 5000)
         sock.bind(serverAddress)
@@ -25,7 +89,7 @@ def NewConfiguration(server, route):
                         if (data.startswith("xxxxxx") and len(sepData) == 3):
                                 d1, d2, d3 = sepData
                                 chanInformation = [d2, d3]
-                                procText.writeText(settingRoute, chanInformation)
+                                procText.writeText(layout["setInfoFile"], chanInformation)
                         else:
                                 print("DATO INVALIDO...")
 
@@ -42,14 +106,17 @@ try:
         logging.info(horaInicio)
         server.start()
         print("Server Online")
-        inputRoute = "/home/rpi/Desktop/SPOTCHANNELS.txt"
-        holdingRoute = "/home/rpi/Desktop/PARAMCHANNELS.txt"
         flag = False
 
         while True:
+                quality = ReadSharedState()
+                inputRoute = layout["spotFile"]
+                holdingRoute = layout["paramFile"]
+                nSpot, nParam = layout["spotCount"], layout["paramCount"]
+
                 if os.stat(inputRoute) != 0:
                         dataInput = procText.readText(inputRoute)
-                        dataInput = dataInput[0:18]
+                        dataInput = dataInput[0:nSpot]
                         #print(dataInput)
                         dataInput = [int(float(element)*100) for element in dataInput]
                         dataInput, indexInputPosition = procText.GreatDataCod(dataInput)
@@ -57,11 +124,13 @@ try:
 
                 if os.stat(holdingRoute) != 0:
                         dataHolding = procText.readText(holdingRoute)
-                        dataHolding = dataHolding[0:29]
+                        dataHolding = dataHolding[0:nParam]
                         #print(dataHolding)
                         dataHolding = [int(float(element)*100) for element in dataHolding]
                         dataHolding, indexHoldingPosition = procText.GreatDataCod(dataHolding)
-                        server.data_bank.set_input_registers(18, dataHolding)
+                        server.data_bank.set_input_registers(nSpot, dataHolding)
+
+                server.data_bank.set_discrete_inputs(0, quality)
 
                 if flag == False:
                         thread1 = threading.Thread(target = NewConfiguration, args = (server, holdingRoute))